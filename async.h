@@ -0,0 +1,252 @@
+
+/* c++11 asynchronous listener pipeline for branching process simulations
+ *
+ * AsyncListener is attached to a BProcess like any other listener, but only
+ * publishes compact event records into single-producer/single-consumer ring
+ * buffers. Consumer threads rebuild ReplayCell stand-ins from those records
+ * and apply the actual listeners, so heavy listeners (FullAgeListener, anything
+ * writing output) run on other cores instead of stalling the simulation loop.
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
+
+#include "branching.h"
+#include "eventlog.h"
+
+/*
+ * Bounded single-producer/single-consumer ring
+ * -- push blocks (yields) while full, which is the backpressure on the simulation
+ * -- pop blocks (yields) while empty
+ */
+template <class T>
+class SPSCRing {
+public:
+  // capacity is rounded up to a power of two
+  SPSCRing(std::size_t cap=1 << 16) : head(0),tail(0)
+  {
+    std::size_t n = 1;
+    while (n < cap) {n <<= 1;}
+    slots.resize(n);
+    mask = n - 1;
+  }
+
+  void push(const T &item)
+  {
+    std::size_t h = head.load(std::memory_order_relaxed);
+    while (h - tail.load(std::memory_order_acquire) > mask) {std::this_thread::yield();}
+    slots[h & mask] = item;
+    head.store(h + 1,std::memory_order_release);
+  }
+  void pop(T &item)
+  {
+    std::size_t t = tail.load(std::memory_order_relaxed);
+    while (head.load(std::memory_order_acquire) == t) {std::this_thread::yield();}
+    item = slots[t & mask];
+    tail.store(t + 1,std::memory_order_release);
+  }
+
+private:
+  std::vector<T> slots;
+  std::size_t mask;
+  // producer and consumer indices on separate cache lines -- padded by hand
+  // rather than alignas, which plain new doesn't honour before c++17
+  char pad0[64];
+  std::atomic<std::size_t> head;
+  char pad1[64 - sizeof(std::atomic<std::size_t>)];
+  std::atomic<std::size_t> tail;
+  char pad2[64 - sizeof(std::atomic<std::size_t>)];
+};
+
+/*
+ * One entry of the event stream
+ * -- init:  time, ncells in id, followed by ncells cell entries
+ * -- event: time, parent id, noffspring in n, followed by noffspring cell entries
+ * -- cell:  age in time, id code (see CellIds) in id, state index in n, weight
+ * -- thin:  time, ndropped in id, nkept in n, followed by ndropped cell entries
+ *           (just the id) then nkept cell entries (id and new weight)
+ * -- finish: consumer exits
+ */
+struct AsyncRecord {
+  enum Kind : uint32_t {init, event, cell, thin, finish};
+  double time;
+  uint64_t id;
+  uint32_t n;
+  Kind kind;
+  double weight; // cell entries only, 0 elsewhere
+};
+
+/*
+ * Listener that hands events to consumer threads
+ *
+ * consumers are Listener<ReplayCell>s -- NCellListener<ReplayCell>,
+ * FullAgeListener<ReplayCell>, ... -- split round robin over nthreads threads,
+ * each with its own ring. Call finish() after BProcess::run before reading the
+ * consumers' results (also done on destruction).
+ */
+template <class WorkingCell>
+class AsyncListener : public Listener<WorkingCell> {
+public:
+  AsyncListener(std::vector< std::shared_ptr< Listener<ReplayCell> > > lst,
+		unsigned int nthreads=1,std::size_t capacity=1 << 16)
+  {
+    if (nthreads == 0) {nthreads = 1;}
+    if (nthreads > lst.size()) {nthreads = ((lst.size() == 0) ? 1 : lst.size());}
+    for (unsigned int i = 0; i < nthreads; ++i) {
+      consumers.emplace_back(new Consumer(capacity,ids,state_lock));
+    }
+    for (std::size_t i = 0; i < lst.size(); ++i) {
+      consumers[i % nthreads]->LArray.push_back(lst[i]);
+    }
+  }
+  ~AsyncListener() {finish();}
+
+  void init(double time,std::vector< std::shared_ptr<WorkingCell> > &cells)
+  {
+    if (!running) {
+      for (auto &c : consumers) {c->start();}
+      running = true;
+    }
+    // states are kept across trajectories so lagging consumers can still resolve them
+    ids.clear(true);
+    publish(AsyncRecord{time,cells.size(),0,AsyncRecord::init,0.0});
+    for (auto c : cells) {publish_cell(time,c,nullptr);}
+  }
+
+  // remember parent, record is published once offspring are known
+  void pop_event(double time,std::shared_ptr<WorkingCell> c)
+  {
+    parent = c.get();
+    parent_id = ids.remove(parent);
+  }
+  void push_event(double time,std::vector< std::shared_ptr<WorkingCell> > &new_cells)
+  {
+    publish(AsyncRecord{time,parent_id,uint32_t(new_cells.size()),AsyncRecord::event,0.0});
+    for (auto c : new_cells) {publish_cell(time,c,parent);}
+  }
+
+  // dropped cells leave the living set, kept cells get their new weights
+  void thin_event(double time,std::vector< std::shared_ptr<WorkingCell> > &dropped,
+		  std::vector< std::shared_ptr<WorkingCell> > &kept)
+  {
+    publish(AsyncRecord{time,dropped.size(),uint32_t(kept.size()),AsyncRecord::thin,0.0});
+    for (auto &c : dropped) {publish(AsyncRecord{0.0,ids.remove(c.get()),0,AsyncRecord::cell,0.0});}
+    for (auto &c : kept) {publish(AsyncRecord{0.0,ids.id(c.get()),0,AsyncRecord::cell,c->weight});}
+  }
+
+  // drain the rings and stop consumer threads
+  void finish()
+  {
+    if (!running) {return;}
+    publish(AsyncRecord{0.0,0,0,AsyncRecord::finish,0.0});
+    for (auto &c : consumers) {c->worker.join();}
+    running = false;
+  }
+
+private:
+  /*
+   * Consumer thread -- owns a ring, its listeners and their replayed cells
+   */
+  struct Consumer {
+    Consumer(std::size_t cap,CellIds<WorkingCell> &i,std::mutex &m) :
+      ring(cap),shared_ids(i),shared_lock(m) {}
+
+    void start() {worker = std::thread(&Consumer::loop,this);}
+
+    void loop()
+    {
+      AsyncRecord rec;
+      std::vector< std::shared_ptr<ReplayCell> > new_cells, dropped;
+      while (true) {
+	ring.pop(rec);
+	if (rec.kind == AsyncRecord::finish) {return;}
+	double time = rec.time;
+	new_cells.clear();
+	if (rec.kind == AsyncRecord::init) {
+	  cells.clear();
+	  for (uint64_t i = 0; i < rec.id; ++i) {new_cells.push_back(next_cell(time,nullptr));}
+	  for (auto l : LArray) {l->init(time,new_cells);}
+	}
+	else if (rec.kind == AsyncRecord::event) {
+	  std::shared_ptr<ReplayCell> par = cells.remove(rec.id,time);
+	  for (auto l : LArray) {l->pop_event(time,par);}
+	  for (uint32_t i = 0; i < rec.n; ++i) {new_cells.push_back(next_cell(time,par));}
+	  for (auto l : LArray) {l->push_event(time,new_cells);}
+	}
+	else if (rec.kind == AsyncRecord::thin) {
+	  uint64_t ndropped = rec.id;
+	  uint32_t nkept = rec.n;
+	  dropped.clear();
+	  for (uint64_t i = 0; i < ndropped; ++i) {
+	    ring.pop(rec);
+	    dropped.push_back(cells.remove(rec.id,time));
+	  }
+	  for (uint32_t i = 0; i < nkept; ++i) {
+	    ring.pop(rec);
+	    std::shared_ptr<ReplayCell> c = cells.living(rec.id);
+	    if (c) {
+	      c->weight = rec.weight;
+	      new_cells.push_back(c);
+	    }
+	  }
+	  for (auto l : LArray) {l->thin_event(time,dropped,new_cells);}
+	}
+      }
+    }
+
+    std::shared_ptr<ReplayCell> next_cell(double time,std::shared_ptr<ReplayCell> par)
+    {
+      AsyncRecord rec;
+      ring.pop(rec);
+      // state table is append only -- refresh the cache on an unseen index
+      if (rec.n >= states.size()) {
+	std::lock_guard<std::mutex> lock(shared_lock);
+	auto &table = shared_ids.state_table();
+	states.insert(states.end(),table.begin() + states.size(),table.end());
+      }
+      return cells.cell(rec.id,time,rec.time,((rec.n < states.size()) ? states[rec.n] : ""),rec.weight,par);
+    }
+
+    SPSCRing<AsyncRecord> ring;
+    std::vector< std::shared_ptr< Listener<ReplayCell> > > LArray;
+    ReplayCells cells;
+    std::vector<std::string> states; // cache of the producer's state table
+    CellIds<WorkingCell> &shared_ids;
+    std::mutex &shared_lock;
+    std::thread worker;
+  };
+
+  void publish(const AsyncRecord &rec)
+  {
+    for (auto &c : consumers) {c->ring.push(rec);}
+  }
+  void publish_cell(double time,std::shared_ptr<WorkingCell> &c,WorkingCell *par)
+  {
+    uint64_t code = ids.code(c.get(),par,parent_id);
+    // a new state is appended under the lock, before the record referencing it is published
+    bool is_new;
+    uint32_t sindex = ids.state_index(c->get_state(),is_new,&state_lock);
+    publish(AsyncRecord{c->get_age(time),code,sindex,AsyncRecord::cell,c->weight});
+  }
+
+  std::vector< std::unique_ptr<Consumer> > consumers;
+  bool running = false;
+  // ids and states of living cells on the simulation side -- the state
+  // table is append only and read by the consumers under state_lock
+  CellIds<WorkingCell> ids;
+  WorkingCell *parent = nullptr;
+  uint64_t parent_id = 0;
+  std::mutex state_lock;
+};
+
+#endif
@@ -14,6 +14,8 @@
 #include <limits>
 #include <queue>
 #include <cmath>
+#include <random>
+#include <algorithm>
 
 /****************
  * CELL CLASSES *
@@ -39,6 +41,9 @@ public:
   virtual std::vector< std::shared_ptr<WorkingCell> > perform_next_event() = 0;
   // Store time of next event to be stored -- should ALWAYS have a value
   double next_event_time;
+  // Number of real cells this one stands for -- only changes when BProcess
+  // thins the population, offspring inherit it from their parent
+  double weight = 1.0;
 };
 
 /*
@@ -86,6 +91,9 @@ std::vector< std::shared_ptr<TestCell> > TestCell::perform_next_event()
  * -- init(time,cells): initialize listener with time and starting cells
  * -- pop_event(time,cell): provide time and cell of a cell event
  * -- push_event(time,cells): provide time and result of the last pop_event
+ *
+ * Optionally, listeners that use cell weights should override
+ * -- thin_event(time,dropped,kept): population was thinned to kept
  */
 template <class WorkingCell>
 class Listener {
@@ -93,6 +101,18 @@ public:
   virtual void init(double time,std::vector< std::shared_ptr<WorkingCell> > &cells) = 0;
   virtual void pop_event(double time,std::shared_ptr<WorkingCell> c) = 0;
   virtual void push_event(double time,std::vector< std::shared_ptr<WorkingCell> > &new_cells) = 0;
+
+  // kept cells already carry their new weights, dropped cells are gone
+  // default treats each dropped cell as a death, ignoring weights
+  virtual void thin_event(double time,std::vector< std::shared_ptr<WorkingCell> > &dropped,
+			  std::vector< std::shared_ptr<WorkingCell> > &kept)
+  {
+    std::vector< std::shared_ptr<WorkingCell> > none;
+    for (auto c : dropped) {
+      pop_event(time,c);
+      push_event(time,none);
+    }
+  }
 };
 
 /***************************
@@ -134,7 +154,8 @@ public:
   void run(double TMAX = std::numeric_limits<double>::max(),
 	   unsigned int NMAX = std::numeric_limits<unsigned int>::max());
 
-  unsigned int num_cells(){return EHeap.size();}
+  // heap cells plus terminal cells parked past TMAX
+  unsigned int num_cells(){return EHeap.size() + Terminal.size();}
 
   // only add listener, will initialize on run
   void add_listener(std::shared_ptr< Listener<WorkingCell> > lst)
@@ -142,6 +163,23 @@ public:
     LArray.push_back(lst);
   }
 
+  // whenever the population grows past threshold, replace it with a
+  // uniform random sample of sample_size cells carrying larger weights
+  // -- needs 0 < sample_size < threshold, otherwise thinning stays off
+  void set_thinning(unsigned int threshold,unsigned int sample_size,
+		    unsigned long seed = std::random_device()())
+  {
+    if (sample_size == 0 || sample_size >= threshold) {
+      std::cout << "Warning: thinning needs 0 < sample_size < threshold, thinning disabled" << std::endl;
+      thin_threshold = std::numeric_limits<unsigned int>::max();
+      thin_sample = 0;
+      return;
+    }
+    thin_threshold = threshold;
+    thin_sample = sample_size;
+    thin_gen.seed(seed);
+  }
+
 private:
   // cell event time compare for event ordering
   // minimum next_event_time based ordering
@@ -159,9 +197,22 @@ private:
 		       std::vector< std::shared_ptr<WorkingCell> >,
 		       CellComp > EHeap;
   
+  // Terminal cells -- next event at or past TMAX, so they never need heap ordering
+  // only the earliest of them can still be popped (as the final event of run)
+  std::vector< std::shared_ptr<WorkingCell> > Terminal;
+  std::size_t terminal_min = 0; // index of earliest terminal cell
+  void add_cell(std::shared_ptr<WorkingCell> c,double TMAX);
+  std::shared_ptr<WorkingCell> next_cell();
+
   // vector for holding simulation listeners
   std::vector< std::shared_ptr< Listener<WorkingCell> > > LArray;
   void init_listeners(double time); 
+
+  // population thinning -- off unless set_thinning is called
+  unsigned int thin_threshold = std::numeric_limits<unsigned int>::max();
+  unsigned int thin_sample = 0;
+  std::mt19937_64 thin_gen;
+  void thin(double time,double TMAX);
 };
 
 // note these template member function initializations need
@@ -179,6 +230,7 @@ void BProcess<WorkingCell,DefaultCell>::init_listeners(double time)
     init_cells.push_back(hcopy.top());
     hcopy.pop();
   }
+  for (auto c : Terminal) {init_cells.push_back(c);}
   
   // initialize each listener with this new vector
   for (auto l : LArray) {
@@ -186,6 +238,86 @@ void BProcess<WorkingCell,DefaultCell>::init_listeners(double time)
   }
 }
 
+/*
+ * Branching Process Implementation - place cell in heap or terminal list
+ *
+ * cells whose next event is at or past TMAX are never popped except
+ * possibly the earliest one, so they skip the heap and we only track the minimum
+ */
+template <class WorkingCell, class DefaultCell>
+void BProcess<WorkingCell,DefaultCell>::add_cell(std::shared_ptr<WorkingCell> c,double TMAX)
+{
+  if (c->next_event_time < TMAX) {
+    EHeap.push(c);
+  }
+  else {
+    if (Terminal.empty() || c->next_event_time < Terminal[terminal_min]->next_event_time) {
+      terminal_min = Terminal.size();
+    }
+    Terminal.push_back(c);
+  }
+}
+
+/*
+ * Branching Process Implementation - remove and return earliest cell event
+ */
+template <class WorkingCell, class DefaultCell>
+std::shared_ptr<WorkingCell> BProcess<WorkingCell,DefaultCell>::next_cell()
+{
+  std::shared_ptr<WorkingCell> c;
+  if (!EHeap.empty() &&
+      (Terminal.empty() || EHeap.top()->next_event_time <= Terminal[terminal_min]->next_event_time)) {
+    c = EHeap.top();
+    EHeap.pop();
+  }
+  else {
+    // earliest terminal cell -- this ends the run, so the rescan happens once
+    c = Terminal[terminal_min];
+    Terminal[terminal_min] = Terminal.back();
+    Terminal.pop_back();
+    terminal_min = 0;
+    for (std::size_t i = 1; i < Terminal.size(); ++i) {
+      if (Terminal[i]->next_event_time < Terminal[terminal_min]->next_event_time) {terminal_min = i;}
+    }
+  }
+  return c;
+}
+
+/*
+ * Branching Process Implementation - thin population to thin_sample cells
+ *
+ * simple random sample without replacement: every cell is kept with the
+ * same probability thin_sample/N, so scaling kept weights by N/thin_sample
+ * keeps weighted totals (N(t), age histograms) unbiased
+ */
+template <class WorkingCell, class DefaultCell>
+void BProcess<WorkingCell,DefaultCell>::thin(double time,double TMAX)
+{
+  std::vector< std::shared_ptr<WorkingCell> > cells;
+  cells.reserve(num_cells());
+  while (!EHeap.empty()) {
+    cells.push_back(EHeap.top());
+    EHeap.pop();
+  }
+  cells.insert(cells.end(),Terminal.begin(),Terminal.end());
+  Terminal.clear();
+
+  // partial Fisher-Yates shuffle puts the sample up front
+  std::size_t n = cells.size();
+  std::size_t k = std::min<std::size_t>(thin_sample,n);
+  for (std::size_t i = 0; i < k; ++i) {
+    std::uniform_int_distribution<std::size_t> pick(i,n - 1);
+    std::swap(cells[i],cells[pick(thin_gen)]);
+  }
+  std::vector< std::shared_ptr<WorkingCell> > dropped(cells.begin() + k,cells.end());
+  cells.resize(k);
+  double factor = double(n) / double(k);
+  for (auto &c : cells) {c->weight *= factor;}
+
+  for (auto l : LArray) {l->thin_event(time,dropped,cells);}
+  for (auto c : cells) {add_cell(c,TMAX);}
+}
+
 /*
  * Branching Process Implementation - main simulation loop
  */
@@ -195,16 +327,20 @@ void BProcess<WorkingCell,DefaultCell>::run(double TMAX,unsigned int NMAX)
   // current time in simulation 
   double current_time = 0.0;
   init_listeners(current_time); // initialize listeners
-  while (current_time < TMAX && num_cells() < NMAX) {
-    std::shared_ptr<WorkingCell> next_cell = EHeap.top(); // grab next cell event
+  while (current_time < TMAX && num_cells() < NMAX && num_cells() > 0) {
+    std::shared_ptr<WorkingCell> next_cell = this->next_cell(); // grab next cell event
     // update current time to next event time
     current_time = next_cell->next_event_time;
     for (auto l : LArray) {l->pop_event(current_time,next_cell);}
-    EHeap.pop(); // remove that element
 
     std::vector< std::shared_ptr<WorkingCell> > new_cells = next_cell->perform_next_event();
+    for (auto &new_cell : new_cells) {new_cell->weight = next_cell->weight;}
     for (auto l: LArray) {l->push_event(current_time,new_cells);}
-    for (auto new_cell : new_cells) {EHeap.push(new_cell);}
+    for (auto new_cell : new_cells) {add_cell(new_cell,TMAX);}
+
+    if (num_cells() > thin_threshold && thin_sample > 0 && current_time < TMAX) {
+      thin(current_time,TMAX);
+    }
   }
 }
 
@@ -11,9 +11,16 @@
 #include <functional>
 #include <random>
 #include <algorithm>
+#include <iomanip>
+#include <limits>
 
 // for use with branching header library
 #include "branching.h"
+#include "sampling.h"
+#include "eventlog.h"
+#include "bhsolver.h"
+#include "ensemble.h"
+#include "async.h"
 
 /*
  * Basic Cell 
@@ -53,11 +60,12 @@ std::vector< std::shared_ptr<BasicCell> > BasicCell::perform_next_event()
   std::vector< std::shared_ptr<BasicCell> > new_cells;
   // keep current BasicCell and produce more
   if (nprogeny >= 1){
+    int n = nprogeny; // get_next_event redraws nprogeny for the updated cell
     // update current cell and place in vector
     birth_time = next_event_time;
     get_next_event();
     new_cells.push_back(shared_from_this());
-    for (int i = 1; i < nprogeny; ++i){
+    for (int i = 1; i < n; ++i){
       new_cells.emplace_back(std::make_shared<BasicCell>(waiting,progeny,birth_time));
     }
   }
@@ -115,11 +123,12 @@ std::vector< std::shared_ptr<AsymmetricCell> > AsymmetricCell::perform_next_even
   if (state == "stalk") {
     // division based on nprogeny
     if (nprogeny >= 1){
+      int n = nprogeny; // get_next_event redraws nprogeny for the updated cell
       // update current cell and place in vector
       last_time = next_event_time;
       get_next_event();
       new_cells.push_back(shared_from_this());
-      for (int i = 1; i < nprogeny; ++i){
+      for (int i = 1; i < n; ++i){
 	// generate new swarmer cells 
 	new_cells.emplace_back(std::make_shared<AsymmetricCell>(waiting,transition,progeny,last_time,"swarmer"));
       }
@@ -225,38 +234,39 @@ public:
   void init(double time,std::vector< std::shared_ptr<WorkingCell> > &cells)
   {
     tkeeper.init_times(times,time); // initialize times and tindex 
-    N = std::vector<unsigned int>(times.size(),0); // initialize N records
-    // current tindex is start
-    N[tkeeper.tindex] += cells.size();
+    N = std::vector<double>(times.size(),0.0); // initialize N records
+    // current tindex is start -- cells count by weight (1 unless thinned)
+    for (auto &c : cells) {N[tkeeper.tindex] += c->weight;}
   }
 
-  // will actually simply ignore pop_event and account for cell removed in push_event
-  void pop_event(double time,std::shared_ptr<WorkingCell> c) {};
+  // only remember weight of the removed cell, it is accounted for in push_event
+  void pop_event(double time,std::shared_ptr<WorkingCell> c) {parent_weight = c->weight;}
   void push_event(double time,std::vector< std::shared_ptr<WorkingCell> > &new_cells)
   {
-    // for event based recording, tells us whether we need a new record
-    if (tkeeper.new_entry(times,time)) {
-      N.push_back(N.back()); // add new N entry
-    }
-
-    // step time and record state until we pass event
-    while (tkeeper.step_time(times,time)) {
-      if (tkeeper.in_range(times))
-	N[tkeeper.tindex] = N[tkeeper.tindex - 1];
-    }
-
     // if event is passed, record result
-    if (tkeeper.record(times,time)) {
-      N[tkeeper.tindex] += new_cells.size() - 1;
+    if (step_to(time)) {
+      for (auto &c : new_cells) {N[tkeeper.tindex] += c->weight;}
+      N[tkeeper.tindex] -= parent_weight;
+    }
+  }
+  // kept cells are now the whole population
+  void thin_event(double time,std::vector< std::shared_ptr<WorkingCell> > &dropped,
+		  std::vector< std::shared_ptr<WorkingCell> > &kept)
+  {
+    if (step_to(time)) {
+      N[tkeeper.tindex] = 0.0;
+      for (auto &c : kept) {N[tkeeper.tindex] += c->weight;}
     }
   }
 
-  // output helpers
+  // output helpers -- counts print exactly, weighted estimates to full precision
   void print()
   {
     for (auto t : times){std::cout << t << ' ';}
     std::cout << std::endl;
+    std::streamsize p = std::cout.precision(std::numeric_limits<double>::digits10);
     for (auto n : N){std::cout << n << ' ';}
+    std::cout.precision(p);
     std::cout << std::endl;
   }
   void write(std::string filename,bool include_times=true,bool append=false)
@@ -273,13 +283,35 @@ public:
 	for (auto t : times) {to_file << t << '\t';}
 	to_file << std::endl;
       }
+      to_file << std::setprecision(std::numeric_limits<double>::digits10);
       for (auto n : N) {to_file << n << '\t';}
       to_file << std::endl;
     }
   }
+
+  // record access, e.g. for ensemble statistics
+  std::vector<double> &get_times() {return times;}
+  std::vector<double> &get_N() {return N;}
 private:
+  // step records up to event time, true if the event should be recorded at tindex
+  bool step_to(double time)
+  {
+    // for event based recording, tells us whether we need a new record
+    if (tkeeper.new_entry(times,time)) {
+      N.push_back(N.back()); // add new N entry
+    }
+
+    // step time and record state until we pass event
+    while (tkeeper.step_time(times,time)) {
+      if (tkeeper.in_range(times))
+	N[tkeeper.tindex] = N[tkeeper.tindex - 1];
+    }
+    return tkeeper.record(times,time);
+  }
+
   std::vector<double> times;
-  std::vector<unsigned int> N;
+  std::vector<double> N; // weighted number of cells
+  double parent_weight = 1.0;
   TimeKeeper tkeeper;
 };
 
@@ -324,6 +356,7 @@ public:
     std::size_t NStates = ((states.size() == 0) ? 1 : states.size());
     ages = std::vector< std::vector< std::vector<double> > >
       (times.size(),std::vector< std::vector<double> >(NStates,std::vector<double>()));
+    weights = ages;
 
     // initialize current cells
     current_cells = cells;
@@ -332,9 +365,7 @@ public:
   void pop_event(double time,std::shared_ptr<WorkingCell> c)
   {
     // step time and record state until we pass event
-    while (tkeeper.step_time(times,time)) {
-      record_ages(times[tkeeper.tindex-1],ages[tkeeper.tindex-1]);
-    }
+    step_to(time);
 
     // need to remove cell from current cell list
     // should be guaranteed to be present
@@ -351,6 +382,13 @@ public:
       current_cells.push_back(c);
     }
   }
+  // kept cells are now the whole population
+  void thin_event(double time,std::vector< std::shared_ptr<WorkingCell> > &dropped,
+		  std::vector< std::shared_ptr<WorkingCell> > &kept)
+  {
+    step_to(time);
+    current_cells = kept;
+  }
   
   // output helpers
   void print()
@@ -397,17 +435,69 @@ public:
     }
   }
 
+  // weights of the recorded ages, same layout as write without header
+  // (all 1 unless the process was thinned)
+  void write_weights(std::string filename,bool append=false)
+  {
+    std::ofstream to_file;
+    if (append) {
+      to_file.open(filename,std::ios::out | std::ios::app);
+    }
+    else {
+      to_file.open(filename,std::ios::out);
+    }
+    if (to_file.is_open()) {
+      to_file << std::setprecision(std::numeric_limits<double>::digits10);
+      for (auto sv : weights)
+      {
+	for (auto wvector : sv)
+	{
+	  for (auto w : wvector) {to_file << w << '\t';}
+	  to_file << std::endl;
+	}
+      }
+    }
+  }
+
+  // weighted mean age at each record time for each state, flattened time-major
+  // (zero where no cells are present)
+  std::vector<double> mean_ages()
+  {
+    std::vector<double> means;
+    for (std::size_t t = 0; t < ages.size(); ++t) {
+      for (std::size_t s = 0; s < ages[t].size(); ++s) {
+	double total = 0.0, wtotal = 0.0;
+	for (std::size_t i = 0; i < ages[t][s].size(); ++i) {
+	  total += weights[t][s][i] * ages[t][s][i];
+	  wtotal += weights[t][s][i];
+	}
+	means.push_back((wtotal == 0.0) ? 0.0 : total / wtotal);
+      }
+    }
+    return means;
+  }
+
 private:
-  void record_ages(double time,std::vector< std::vector<double> > &dest)
+  // step time and record ages at every record time the event passes
+  void step_to(double time)
+  {
+    while (tkeeper.step_time(times,time)) {
+      record_ages(times[tkeeper.tindex-1],ages[tkeeper.tindex-1],weights[tkeeper.tindex-1]);
+    }
+  }
+  void record_ages(double time,std::vector< std::vector<double> > &dest,
+		   std::vector< std::vector<double> > &wdest)
   {
     // empty destination vector to be safe
     std::size_t NStates = ((states.size() == 0) ? 1 : states.size());
     dest = std::vector< std::vector<double> >(NStates,std::vector<double>());
+    wdest = dest;
     // we just need to add ages of all current cells
     for (auto c : current_cells) {
       // need to check state
       int dindex = ((states.size() == 0) ? 0 : state_index(c->get_state()));
       dest[dindex].push_back(c->get_age(time));
+      wdest[dindex].push_back(c->weight);
     }
   }
   int state_index(std::string s)
@@ -423,6 +513,7 @@ private:
   // hold age info at designated times
   // at each time point, set of age vectors for each state
   std::vector< std::vector< std::vector<double> > > ages;
+  std::vector< std::vector< std::vector<double> > > weights; // matching cell weights
   // continuously update cell list
   std::vector< std::shared_ptr<WorkingCell> > current_cells;
   // for keeping track of states
@@ -498,6 +589,163 @@ void run_basic() {
 }
 */
 
+/*
+ * Storing routine to log basic cell runs once and replay them into
+ * listeners afterwards -- new statistics don't need a new ensemble
+ *
+ * Needs some functions/rngs to be defined to work
+ */
+/*
+void run_logged() {
+  std::vector<double> times;
+  double dmax = 14.0;
+  for (double d = 0.0; d < dmax || std::abs(d-dmax) < 1e-6; d += 0.1) {
+    times.push_back(d);
+  }
+
+  int ntrials = 200;
+  std::string logname = "results/basic_gam5_02_p2.blog";
+  for (int i = 0; i < ntrials; ++i) {
+    // first run starts new log, later runs append
+    auto Llst = std::make_shared< EventLogListener<BasicCell> >(logname,i != 0);
+    BProcess<BasicCell> bp(1,gam_wt,default_progeny);
+    bp.add_listener(Llst);
+    bp.run(dmax,1e8);
+    std::cout << i << std::endl;
+  }
+
+  // replay every logged trajectory into a full age listener
+  std::string filename = "results/basic_fullage_gam5_02_p2.txt";
+  EventLogReader reader(logname);
+  for (int i = 0; ; ++i) {
+    auto FAlst = std::make_shared< FullAgeListener<ReplayCell> >(times,1e-6);
+    if (!reader.replay(FAlst)) break;
+    FAlst->write(filename,i == 0,i != 0);
+  }
+}
+*/
+
+/*
+ * Storing routine to compute mean/variance of N cells without simulation
+ * -- deterministic counterpart of the run_ncells ensembles
+ */
+/*
+void run_moments() {
+  std::vector<double> times;
+  double dmax = 14.0;
+  for (double d = 0.0; d < dmax || std::abs(d-dmax) < 1e-6; d += 0.01) {
+    times.push_back(d);
+  }
+
+  // gamma(5,0.2) waiting time, always 2 progeny
+  BHSolver basic(times,1e-3);
+  basic.solve_basic(bhsolver::gamma_density(5.0,0.2),std::vector<double>{0.0,0.0,1.0});
+  basic.write("results/basic_ncell_moments_gam5_02_p2.txt");
+
+  // exp(1) division, exp(0.5) swarmer transition, starting from a stalk cell
+  BHSolver asym(times,1e-3);
+  asym.solve_asymmetric(bhsolver::exponential_density(1.0),bhsolver::exponential_density(0.5),
+			std::vector<double>{0.0,0.0,1.0},"stalk");
+  asym.write("results/asymmetric_ncell_moments_exp1_exp2_p2.txt");
+}
+*/
+
+/*
+ * Storing routine to estimate N cells in time to a target precision
+ * -- runs parallel batches until every confidence interval is within 5% of its mean
+ */
+/*
+void run_adaptive() {
+  std::vector<double> times;
+  double dmax = 14.0;
+  for (double d = 0.0; d < dmax || std::abs(d-dmax) < 1e-6; d += 0.1) {
+    times.push_back(d);
+  }
+
+  AdaptiveEnsemble ens(0.05,20000);
+  ens.run([&](unsigned long seed) {
+      // each worker owns its rng and waiting functions -- cells hold references to these
+      struct Worker {
+	std::mt19937_64 gen;
+	std::gamma_distribution<double> gam{5.0,0.2};
+	std::function<double()> gam_wt = [this](){return gam(gen);};
+	std::function<int()> default_progeny = [](){return 2;};
+      };
+      auto wk = std::make_shared<Worker>();
+      wk->gen.seed(seed);
+      return AdaptiveEnsemble::Trial([&times,wk,dmax]() {
+	  auto Nlst = std::make_shared< NCellListener<BasicCell> >(times,1e-6);
+	  BProcess<BasicCell> bp(1,wk->gam_wt,wk->default_progeny);
+	  bp.add_listener(Nlst);
+	  bp.run(dmax,1e8);
+	  return std::vector<double>(Nlst->get_N().begin(),Nlst->get_N().end());
+	});
+    });
+  ens.write("results/basic_ncell_adaptive_gam5_02_p2.txt",times);
+}
+*/
+
+/*
+ * Storing routine to record full ages off the simulation thread
+ * -- listeners see ReplayCells rebuilt from the async event stream
+ *
+ * Needs some functions/rngs to be defined to work
+ */
+/*
+void run_async() {
+  std::vector<double> times;
+  double dmax = 14.0;
+  for (double d = 0.0; d < dmax || std::abs(d-dmax) < 1e-6; d += 0.1) {
+    times.push_back(d);
+  }
+
+  int ntrials = 200;
+  std::string filename = "results/basic_fullage_gam5_02_p2.txt";
+  for (int i = 0; i < ntrials; ++i) {
+    auto FAlst = std::make_shared< FullAgeListener<ReplayCell> >(times,1e-6);
+    std::vector< std::shared_ptr< Listener<ReplayCell> > > consumers{FAlst};
+    auto Alst = std::make_shared< AsyncListener<BasicCell> >(consumers);
+    BProcess<BasicCell> bp(1,gam_wt,default_progeny);
+    bp.add_listener(Alst);
+    bp.run(dmax,1e8);
+    Alst->finish(); // wait for consumer before writing
+    FAlst->write(filename,i == 0,i != 0);
+    std::cout << i << std::endl;
+  }
+}
+*/
+
+/*
+ * Storing routine to estimate age distributions from a thinned population
+ * -- past 1e5 cells the process keeps a weighted sample of 5e4, so memory
+ *    and time per trajectory no longer grow with the true population
+ *
+ * Needs some functions/rngs to be defined to work
+ */
+/*
+void run_thinned() {
+  std::vector<double> times;
+  double dmax = 20.0;
+  for (double d = 0.0; d < dmax || std::abs(d-dmax) < 1e-6; d += 0.1) {
+    times.push_back(d);
+  }
+
+  int ntrials = 200;
+  std::string filename = "results/basic_fullage_gam5_02_p2_thinned.txt";
+  std::string wfilename = "results/basic_fullage_gam5_02_p2_thinned_weights.txt";
+  for (int i = 0; i < ntrials; ++i) {
+    auto FAlst = std::make_shared< FullAgeListener<BasicCell> >(times,1e-6);
+    BProcess<BasicCell> bp(1,gam_wt,default_progeny);
+    bp.set_thinning(100000,50000);
+    bp.add_listener(FAlst);
+    bp.run(dmax,1e8);
+    FAlst->write(filename,i == 0,i != 0);
+    FAlst->write_weights(wfilename,i != 0);
+    std::cout << i << std::endl;
+  }
+}
+*/
+
 #include <iomanip>
 #include <map>
 
@@ -508,21 +756,23 @@ int main(int argc, char const ** argv){
   std::mt19937_64 gen(rd());
 
   // construct waiting time function 
-  std::exponential_distribution<double> exp(1.0);
-  std::function<double()> exp_wt = [&](){return exp(gen);};
-  std::gamma_distribution<double> gam(3.0,1.0/3.0);
-  std::function<double()> gam_wt = [&](){return gam(gen);};
+  // block samplers -- draws are buffered per process, see sampling.h
+  BatchSampler<ExponentialBlock,std::mt19937_64> exp(gen,ExponentialBlock(1.0));
+  std::function<double()> exp_wt = [&](){return exp();};
+  BatchSampler<GammaBlock,std::mt19937_64> gam(gen,GammaBlock(3.0,1.0/3.0));
+  std::function<double()> gam_wt = [&](){return gam();};
   std::function<double()> default_waiting = [](){return 1.0;};
   // second gamma for swarmers
-  std::gamma_distribution<double> gam2(5.0,0.2);
-  std::function<double()> gam2_wt = [&](){return gam2(gen);};
+  BatchSampler<GammaBlock,std::mt19937_64> gam2(gen,GammaBlock(5.0,0.2));
+  std::function<double()> gam2_wt = [&](){return gam2();};
   // second exp for swarmers
-  std::exponential_distribution<double> exp2(0.5);
-  std::function<double()> exp2_wt = [&](){return exp2(gen);};
+  BatchSampler<ExponentialBlock,std::mt19937_64> exp2(gen,ExponentialBlock(0.5));
+  std::function<double()> exp2_wt = [&](){return exp2();};
 
-  // bimodal waiting time
-  std::bernoulli_distribution bern(0.5);
-  std::function<double()> bimod_wt = [&](){return bern(gen) ? exp(gen) : gam(gen);};
+  // bimodal waiting time -- half exp(1.0), half gamma(3.0,1/3)
+  auto bimod_kernel = make_mixture(0.5,ExponentialBlock(1.0),GammaBlock(3.0,1.0/3.0));
+  BatchSampler<decltype(bimod_kernel),std::mt19937_64> bimod(gen,bimod_kernel);
+  std::function<double()> bimod_wt = [&](){return bimod();};
   
   // construct simple number of progeny produced per division
   std::function<int()> default_progeny = [](){return 2;};
@@ -0,0 +1,270 @@
+
+/* c++11 adaptive ensemble runner for branching process simulations
+ *
+ * Instead of a fixed ntrials, trajectories are run in parallel batches
+ * until every chosen statistic (N(t) at given times, mean age per state, ...)
+ * has a confidence interval narrower than a relative target, or until the
+ * trial/time budget runs out. The achieved precision is reported with the means.
+ */
+
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Running mean/variance (Welford) -- mergeable across worker threads
+ */
+struct RunningStat {
+  double n = 0.0;
+  double mean = 0.0;
+  double m2 = 0.0;
+  void add(double x)
+  {
+    n += 1.0;
+    double d = x - mean;
+    mean += d / n;
+    m2 += d * (x - mean);
+  }
+  void merge(const RunningStat &o)
+  {
+    if (o.n == 0.0) {return;}
+    double tot = n + o.n;
+    double d = o.mean - mean;
+    mean += d * o.n / tot;
+    m2 += o.m2 + d * d * n * o.n / tot;
+    n = tot;
+  }
+  double variance() const {return ((n > 1.0) ? m2 / (n - 1.0) : 0.0);}
+};
+
+/*
+ * Adaptive ensemble of independent trajectories
+ *
+ * A trial is one trajectory returning its statistics as a vector of doubles.
+ * Trials are built once per worker thread from a seed, so each thread owns
+ * its rng and waiting time functions (cells hold those by reference):
+ *   ens.run([&](unsigned long seed) {
+ *     auto gen = std::make_shared<std::mt19937_64>(seed);
+ *     ...
+ *     return AdaptiveEnsemble::Trial([=](){ ... return stats; });
+ *   });
+ *
+ * Stopping rule: every statistic i must satisfy
+ *   2 * z * sd_i / sqrt(n) <= target_i * |mean_i|
+ * After the pilot each batch is what the current variances say is still
+ * needed, but never more than the trials done so far (batches at most double).
+ */
+class AdaptiveEnsemble {
+public:
+  typedef std::function< std::vector<double>() > Trial;
+
+  AdaptiveEnsemble(double REL=0.05,unsigned int MAXTRIALS=100000,double Z=1.96,
+		   unsigned int nthreads=std::thread::hardware_concurrency()) :
+    rel_width(REL),max_trials(MAXTRIALS),z(Z),workers((nthreads == 0) ? 1 : nthreads) {}
+
+  // per statistic relative width targets -- otherwise REL for all of them
+  void set_targets(std::vector<double> t) {targets = t;}
+  // stop after this many seconds of wall time even if targets aren't met (0 = no limit)
+  // -- workers check the deadline before each trial, so the overshoot is one trial
+  void set_time_budget(double seconds) {max_seconds = seconds;}
+  // trials in the pilot batch used to get first variance estimates
+  void set_pilot(unsigned int n) {pilot = n;}
+  // seed for the per worker seeds, defaults to std::random_device
+  // -- all 64 bits are used, seed_seq gets the low and high halves
+  void set_seed(unsigned long s) {seed = s; seeded = true;}
+
+  // returns true if every target was met within budget
+  bool run(std::function<Trial(unsigned long)> make_trial)
+  {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(max_seconds));
+    if (!seeded) {
+      std::random_device rd;
+      seed = rd();
+    }
+    // seed_seq only keeps 32 bits per element
+    uint64_t s64 = seed;
+    std::seed_seq sseq{uint32_t(s64),uint32_t(s64 >> 32)};
+    std::vector<uint32_t> seeds(2*workers);
+    sseq.generate(seeds.begin(),seeds.end());
+    std::vector<Trial> trials;
+    for (unsigned int w = 0; w < workers; ++w) {
+      trials.push_back(make_trial((unsigned long)(seeds[2*w] | (uint64_t(seeds[2*w+1]) << 32))));
+    }
+
+    stats.clear();
+    ntrials = 0;
+    nrun = 0;
+    converged = false;
+    unsigned int next = std::min(pilot,max_trials);
+    while (next > 0) {
+      run_batch(trials,next,deadline);
+      converged = targets_met();
+      if (converged || nrun >= max_trials ||
+	  (max_seconds > 0.0 && std::chrono::steady_clock::now() >= deadline)) {break;}
+      next = needed_trials() - std::min(needed_trials(),ntrials);
+      // grow geometrically so a poor pilot estimate can't commit to a huge batch
+      next = std::min(next,std::max(ntrials,pilot));
+      // always make some progress, and spread over all workers
+      next = std::min(std::max(next,workers),max_trials - nrun);
+    }
+    return converged;
+  }
+
+  // results
+  std::vector<double> mean()
+  {
+    std::vector<double> m;
+    for (auto &s : stats) {m.push_back(s.mean);}
+    return m;
+  }
+  // confidence interval half widths
+  std::vector<double> half_width()
+  {
+    std::vector<double> hw;
+    for (auto &s : stats) {hw.push_back(z * std::sqrt(s.variance() / s.n));}
+    return hw;
+  }
+  // achieved relative width -- compare against targets
+  std::vector<double> rel_precision()
+  {
+    std::vector<double> rp;
+    for (auto &s : stats) {
+      double hw = z * std::sqrt(s.variance() / s.n);
+      rp.push_back((hw == 0.0) ? 0.0 : 2.0 * hw / std::abs(s.mean));
+    }
+    return rp;
+  }
+  unsigned int num_trials() {return ntrials;}
+  bool met_targets() {return converged;}
+
+  // output helpers -- optional header row (e.g. record times),
+  // then mean, half width and relative width rows, then trial count
+  void print()
+  {
+    for (auto m : mean()) {std::cout << m << ' ';}
+    std::cout << std::endl;
+    for (auto h : half_width()) {std::cout << h << ' ';}
+    std::cout << std::endl;
+    for (auto r : rel_precision()) {std::cout << r << ' ';}
+    std::cout << std::endl;
+    std::cout << ntrials << ' ' << converged << std::endl;
+  }
+  void write(std::string filename,std::vector<double> header=std::vector<double>(),bool append=false)
+  {
+    std::ofstream to_file;
+    if (append) {
+      to_file.open(filename,std::ios::out | std::ios::app);
+    }
+    else {
+      to_file.open(filename,std::ios::out);
+    }
+    if (to_file.is_open()) {
+      if (header.size() != 0){
+	for (auto h : header) {to_file << h << '\t';}
+	to_file << std::endl;
+      }
+      for (auto m : mean()) {to_file << m << '\t';}
+      to_file << std::endl;
+      for (auto h : half_width()) {to_file << h << '\t';}
+      to_file << std::endl;
+      for (auto r : rel_precision()) {to_file << r << '\t';}
+      to_file << std::endl;
+      to_file << ntrials << '\t' << converged << '\t' << std::endl;
+    }
+  }
+
+private:
+  // run n trials spread over the workers (fewer if the deadline passes),
+  // then merge their statistics
+  void run_batch(std::vector<Trial> &trials,unsigned int n,
+		 std::chrono::steady_clock::time_point deadline)
+  {
+    std::vector< std::vector<RunningStat> > local(workers);
+    std::vector<unsigned int> done(workers,0), attempted(workers,0);
+    std::vector<std::thread> threads;
+    bool timed = (max_seconds > 0.0);
+    for (unsigned int w = 0; w < workers; ++w) {
+      unsigned int share = n / workers + ((w < n % workers) ? 1 : 0);
+      if (share == 0) {continue;}
+      threads.emplace_back([&trials,&local,&done,&attempted,w,share,timed,deadline](){
+	  for (unsigned int i = 0; i < share; ++i) {
+	    if (timed && std::chrono::steady_clock::now() >= deadline) {return;}
+	    ++attempted[w];
+	    std::vector<double> x = trials[w]();
+	    if (local[w].empty()) {local[w].resize(x.size());}
+	    if (x.size() != local[w].size()) {
+	      std::cout << "Warning: trial returned inconsistent number of statistics" << std::endl;
+	      continue;
+	    }
+	    for (std::size_t k = 0; k < x.size(); ++k) {local[w][k].add(x[k]);}
+	    ++done[w];
+	  }
+	});
+    }
+    for (auto &t : threads) {t.join();}
+    for (unsigned int w = 0; w < workers; ++w) {
+      nrun += attempted[w];
+      if (stats.empty()) {stats.resize(local[w].size());}
+      if (local[w].size() != stats.size()) {continue;}
+      for (std::size_t k = 0; k < stats.size(); ++k) {stats[k].merge(local[w][k]);}
+      ntrials += done[w];
+    }
+  }
+
+  double target(std::size_t k) {return ((k < targets.size()) ? targets[k] : rel_width);}
+
+  bool targets_met()
+  {
+    if (ntrials < 2) {return false;}
+    for (std::size_t k = 0; k < stats.size(); ++k) {
+      double hw = z * std::sqrt(stats[k].variance() / stats[k].n);
+      if (2.0 * hw > target(k) * std::abs(stats[k].mean)) {return false;}
+    }
+    return true;
+  }
+
+  // estimated total trials for every statistic to meet its target
+  unsigned int needed_trials()
+  {
+    double need = 0.0;
+    for (std::size_t k = 0; k < stats.size(); ++k) {
+      double m = std::abs(stats[k].mean);
+      double v = stats[k].variance();
+      if (v == 0.0) {continue;}
+      if (m == 0.0) {return max_trials;} // relative width can't be reached on a zero mean
+      double w = target(k) * m / (2.0 * z);
+      need = std::max(need,v / (w * w));
+    }
+    return (unsigned int)(std::min(std::ceil(need),double(max_trials)));
+  }
+
+  double rel_width;
+  unsigned int max_trials;
+  double z;
+  unsigned int workers;
+  std::vector<double> targets;
+  double max_seconds = 0.0;
+  unsigned int pilot = 50;
+  unsigned long seed = 0;
+  bool seeded = false;
+
+  std::vector<RunningStat> stats;
+  unsigned int ntrials = 0; // trials merged into stats
+  unsigned int nrun = 0; // trials run, including skipped ones -- counts against max_trials
+  bool converged = false;
+};
+
+#endif
@@ -0,0 +1,504 @@
+
+/* c++11 event logging and offline replay for branching process simulations
+ *
+ * EventLogListener records every cell event of a BProcess run into a compact
+ * binary log. EventLogReader later drives any Listener from that log, so new
+ * statistics (other time grids, per-state ages, histograms) can be computed
+ * without resimulating the ensemble.
+ */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+
+#include "branching.h"
+
+/*
+ * Log format -- one or more trajectories appended back to back
+ *
+ * trajectory := header (event | thin)* end
+ * header     := "BLOG" version(u8) start_time(f64) ncells(varint) cell*
+ * event      := 2*(noffspring+1)(varint) dt(f64) parent_id(varint) cell*
+ * thin       := (2*ndropped+1)(varint) dt(f64) dropped_id(varint)*
+ *               nkept(varint) (kept_id(varint) weight(f64))*
+ * end        := 0(varint)
+ * cell       := id_code(varint) state_code(varint) [state string] [age(f64)] [weight(f64)]
+ *
+ * -- dt is the time since the previous event (or start_time)
+ * -- id_code: 0 = new cell taking the next free id, 1 = the parent itself,
+ *    k+2 = already living cell k. Ids are assigned in order of appearance
+ * -- state_code = (state_index << 2) | (has_weight << 1) | has_age. A state_index
+ *    equal to the current table size introduces a new state: varint length then bytes
+ * -- age is only stored when non-zero (new cells and reset parents have age 0)
+ * -- weight is only stored when it differs from the parent's (1 for initial cells),
+ *    so unthinned runs carry no weights; thin records hold the rescaled weights
+ * -- f64 values are written in native byte order
+ */
+namespace eventlog {
+  const char magic[4] = {'B','L','O','G'};
+  const unsigned char version = 2;
+  const std::size_t buffer_size = 1 << 20;
+}
+
+/*
+ * Ids and states of living cells on the recording side
+ * -- ids are assigned in order of appearance, states are indexed
+ *    in order of appearance, both reset per trajectory
+ *    (the asynchronous pipeline keeps states, see async.h)
+ * shared by the event log and the asynchronous listener pipeline
+ */
+template <class WorkingCell>
+class CellIds {
+public:
+  void clear(bool keep_states=false)
+  {
+    ids.clear();
+    if (!keep_states) {states.clear();}
+    next_id = 0;
+  }
+
+  // popped cell leaves the living set until it shows up among the offspring
+  uint64_t remove(WorkingCell *c)
+  {
+    auto cit = ids.find(c);
+    if (cit == ids.end()) {
+      std::cout << "Warning: couldn't find cell in event recording" << std::endl;
+      return 0;
+    }
+    uint64_t id = cit->second;
+    ids.erase(cit);
+    return id;
+  }
+
+  // id of a living cell
+  uint64_t id(WorkingCell *c)
+  {
+    auto cit = ids.find(c);
+    if (cit == ids.end()) {
+      std::cout << "Warning: couldn't find cell in event recording" << std::endl;
+      return 0;
+    }
+    return cit->second;
+  }
+
+  // id code of a new or offspring cell: 0 new, 1 the parent, k+2 living cell k
+  uint64_t code(WorkingCell *c,WorkingCell *par,uint64_t parent_id)
+  {
+    if (c == par) {
+      ids[c] = parent_id;
+      return 1;
+    }
+    auto cit = ids.find(c);
+    if (cit != ids.end()) {return cit->second + 2;}
+    ids[c] = next_id++;
+    return 0;
+  }
+
+  // index of state, bool set if this is the first time it's been seen
+  // -- lock, if given, is held while appending so other threads can read the table
+  uint64_t state_index(const std::string &s,bool &is_new,std::mutex *lock=nullptr)
+  {
+    auto sit = std::find(states.begin(),states.end(),s);
+    uint64_t index = std::distance(states.begin(),sit);
+    is_new = (sit == states.end());
+    if (is_new && lock) {
+      std::lock_guard<std::mutex> guard(*lock);
+      states.push_back(s);
+    }
+    else if (is_new) {
+      states.push_back(s);
+    }
+    return index;
+  }
+  // state table -- other threads must hold the lock passed to state_index
+  const std::vector<std::string> &state_table() {return states;}
+
+private:
+  std::unordered_map<WorkingCell*,uint64_t> ids;
+  uint64_t next_id = 0;
+  std::vector<std::string> states;
+};
+
+/*
+ * Stand-in cell reconstructed from an event log
+ * -- provides get_age and get_state so the usual listeners can be driven
+ */
+class ReplayCell {
+public:
+  ReplayCell(uint64_t i,double ref,std::string s) : id(i),ref_time(ref),state(s) {}
+  double get_age(double t) {return t - ref_time;}
+  std::string get_state() {return state;}
+  uint64_t id;
+  double ref_time; // time at which age was zero
+  std::string state;
+  double weight = 1.0; // as recorded, changes when the population was thinned
+};
+
+/*
+ * Living cells on the replay side -- mirror of CellIds
+ */
+class ReplayCells {
+public:
+  void clear()
+  {
+    cells.clear();
+    next_id = 0;
+  }
+
+  // popped cell leaves the living set until it shows up among the offspring
+  std::shared_ptr<ReplayCell> remove(uint64_t id,double time)
+  {
+    auto cit = cells.find(id);
+    if (cit == cells.end()) {
+      std::cout << "Warning: unknown parent in event replay" << std::endl;
+      return std::make_shared<ReplayCell>(id,time,"");
+    }
+    std::shared_ptr<ReplayCell> c = cit->second;
+    cells.erase(cit);
+    return c;
+  }
+
+  // living cell by id, null if unknown
+  std::shared_ptr<ReplayCell> living(uint64_t id)
+  {
+    auto cit = cells.find(id);
+    if (cit == cells.end()) {
+      std::cout << "Warning: unknown cell in event replay" << std::endl;
+      return nullptr;
+    }
+    return cit->second;
+  }
+
+  // cell for an id code from CellIds::code, updated with its current state, age and weight
+  std::shared_ptr<ReplayCell> cell(uint64_t idcode,double time,double age,const std::string &state,
+				   double weight,std::shared_ptr<ReplayCell> par)
+  {
+    std::shared_ptr<ReplayCell> c;
+    if (idcode == 0) {
+      c = std::make_shared<ReplayCell>(next_id++,time,state);
+    }
+    else if (idcode == 1 && par) {
+      c = par;
+    }
+    else {
+      auto cit = cells.find(idcode - 2);
+      c = ((cit != cells.end()) ? cit->second : std::make_shared<ReplayCell>(idcode - 2,time,state));
+    }
+    cells[c->id] = c;
+    c->state = state;
+    c->ref_time = time - age;
+    c->weight = weight;
+    return c;
+  }
+
+private:
+  std::unordered_map< uint64_t,std::shared_ptr<ReplayCell> > cells;
+  uint64_t next_id = 0;
+};
+
+/*
+ * Record every event of a simulation into a binary log
+ *
+ * template class to guarantee that the cell has get_age and get_state methods
+ * one trajectory is written per init; the trajectory is terminated on the next
+ * init, on close(), or when the listener is destroyed
+ */
+template <class WorkingCell>
+class EventLogListener : public Listener<WorkingCell> {
+public:
+  EventLogListener(std::string filename,bool append=false)
+  {
+    if (append) {
+      to_file.open(filename,std::ios::out | std::ios::binary | std::ios::app);
+    }
+    else {
+      to_file.open(filename,std::ios::out | std::ios::binary);
+    }
+    if (!to_file.is_open()) {
+      std::cout << "Warning: couldn't open event log " << filename << std::endl;
+    }
+  }
+  ~EventLogListener() {close();}
+
+  void init(double time,std::vector< std::shared_ptr<WorkingCell> > &cells)
+  {
+    end_trajectory(); // in case the listener is reused
+    ids.clear();
+    last_time = time;
+    open_trajectory = true;
+
+    buffer.append(eventlog::magic,4);
+    buffer.push_back(char(eventlog::version));
+    put_double(time);
+    put_varint(cells.size());
+    for (auto c : cells) {put_cell(time,c,nullptr,1.0);}
+  }
+
+  // remember parent, actual record is written once offspring are known
+  void pop_event(double time,std::shared_ptr<WorkingCell> c)
+  {
+    parent = c.get();
+    parent_id = ids.remove(parent);
+  }
+  void push_event(double time,std::vector< std::shared_ptr<WorkingCell> > &new_cells)
+  {
+    put_varint(2 * (new_cells.size() + 1));
+    put_double(time - last_time);
+    put_varint(parent_id);
+    for (auto c : new_cells) {put_cell(time,c,parent,parent->weight);}
+    last_time = time;
+    if (buffer.size() >= eventlog::buffer_size) {flush();}
+  }
+
+  // dropped cells leave the living set, kept cells get their new weights
+  void thin_event(double time,std::vector< std::shared_ptr<WorkingCell> > &dropped,
+		  std::vector< std::shared_ptr<WorkingCell> > &kept)
+  {
+    put_varint(2 * dropped.size() + 1);
+    put_double(time - last_time);
+    for (auto &c : dropped) {put_varint(ids.remove(c.get()));}
+    put_varint(kept.size());
+    for (auto &c : kept) {
+      put_varint(ids.id(c.get()));
+      put_double(c->weight);
+    }
+    last_time = time;
+    if (buffer.size() >= eventlog::buffer_size) {flush();}
+  }
+
+  // terminate current trajectory and flush everything to disk
+  void close()
+  {
+    end_trajectory();
+    flush();
+    if (to_file.is_open()) {to_file.close();}
+  }
+
+private:
+  void end_trajectory()
+  {
+    if (open_trajectory) {
+      put_varint(0);
+      open_trajectory = false;
+    }
+  }
+  void flush()
+  {
+    if (to_file.is_open() && !buffer.empty()) {
+      to_file.write(buffer.data(),buffer.size());
+    }
+    buffer.clear();
+  }
+
+  // ref_weight is what replay assumes when no weight is stored
+  void put_cell(double time,std::shared_ptr<WorkingCell> &c,WorkingCell *par,double ref_weight)
+  {
+    put_varint(ids.code(c.get(),par,parent_id));
+
+    // state, age and weight
+    std::string s = c->get_state();
+    bool new_state;
+    uint64_t sindex = ids.state_index(s,new_state);
+    double age = c->get_age(time);
+    bool has_weight = (c->weight != ref_weight);
+    put_varint((sindex << 2) | (has_weight ? 2 : 0) | ((age != 0.0) ? 1 : 0));
+    if (new_state) {
+      put_varint(s.size());
+      buffer.append(s);
+    }
+    if (age != 0.0) {put_double(age);}
+    if (has_weight) {put_double(c->weight);}
+  }
+
+  void put_varint(uint64_t v)
+  {
+    while (v >= 0x80) {
+      buffer.push_back(char((v & 0x7F) | 0x80));
+      v >>= 7;
+    }
+    buffer.push_back(char(v));
+  }
+  void put_double(double d)
+  {
+    char bytes[sizeof(double)];
+    std::memcpy(bytes,&d,sizeof(double));
+    buffer.append(bytes,sizeof(double));
+  }
+
+  std::ofstream to_file;
+  std::string buffer; // pending output
+  // ids and states of living cells
+  CellIds<WorkingCell> ids;
+  // last popped cell, waiting for its push_event
+  WorkingCell *parent = nullptr;
+  uint64_t parent_id = 0;
+  double last_time = 0.0;
+  bool open_trajectory = false;
+};
+
+/*
+ * Replay trajectories from an event log into listeners
+ *
+ * Each call to replay reads the next trajectory and drives the given
+ * listeners exactly as BProcess::run would have (init, then pop/push
+ * for every event). Returns false once the log is exhausted.
+ */
+class EventLogReader {
+public:
+  EventLogReader(std::string filename) : from_file(filename,std::ios::in | std::ios::binary)
+  {
+    if (!from_file.is_open()) {
+      std::cout << "Warning: couldn't open event log " << filename << std::endl;
+    }
+  }
+
+  bool replay(std::shared_ptr< Listener<ReplayCell> > lst)
+  {
+    std::vector< std::shared_ptr< Listener<ReplayCell> > > larray(1,lst);
+    return replay(larray);
+  }
+  bool replay(std::vector< std::shared_ptr< Listener<ReplayCell> > > &larray)
+  {
+    char hdr[4];
+    if (!get_bytes(hdr,4)) {return false;} // clean end of log
+    if (std::memcmp(hdr,eventlog::magic,4) != 0) {
+      std::cout << "Warning: bad event log header" << std::endl;
+      return false;
+    }
+    char ver;
+    get_bytes(&ver,1);
+    if ((unsigned char)(ver) != eventlog::version) {
+      std::cout << "Warning: unknown event log version" << std::endl;
+      return false;
+    }
+
+    cells.clear();
+    states.clear();
+    double time = get_double();
+
+    // initial cells
+    std::vector< std::shared_ptr<ReplayCell> > new_cells;
+    uint64_t ninit = get_varint();
+    for (uint64_t i = 0; i < ninit; ++i) {
+      new_cells.push_back(get_cell(time,nullptr));
+    }
+    for (auto l : larray) {l->init(time,new_cells);}
+
+    // events and thinnings until end marker
+    uint64_t code;
+    std::vector< std::shared_ptr<ReplayCell> > dropped;
+    while (good && (code = get_varint()) != 0) {
+      time += get_double();
+      new_cells.clear();
+      if (code & 1) {
+	dropped.clear();
+	for (uint64_t i = 0; i < (code >> 1); ++i) {
+	  dropped.push_back(cells.remove(get_varint(),time));
+	}
+	uint64_t nkept = get_varint();
+	for (uint64_t i = 0; i < nkept && good; ++i) {
+	  std::shared_ptr<ReplayCell> c = cells.living(get_varint());
+	  double w = get_double();
+	  if (c) {
+	    c->weight = w;
+	    new_cells.push_back(c);
+	  }
+	}
+	for (auto l : larray) {l->thin_event(time,dropped,new_cells);}
+	continue;
+      }
+
+      std::shared_ptr<ReplayCell> par = cells.remove(get_varint(),time);
+      for (auto l : larray) {l->pop_event(time,par);}
+      for (uint64_t i = 1; i < (code >> 1); ++i) {
+	new_cells.push_back(get_cell(time,par));
+      }
+      for (auto l : larray) {l->push_event(time,new_cells);}
+    }
+    if (!good) {
+      std::cout << "Warning: truncated event log" << std::endl;
+    }
+    return good;
+  }
+
+private:
+  std::shared_ptr<ReplayCell> get_cell(double time,std::shared_ptr<ReplayCell> par)
+  {
+    uint64_t idcode = get_varint();
+
+    // state, age and weight
+    uint64_t scode = get_varint();
+    uint64_t sindex = scode >> 2;
+    if (sindex == states.size()) {
+      std::string s(get_varint(),'\0');
+      if (!s.empty()) {get_bytes(&s[0],s.size());}
+      states.push_back(s);
+    }
+    std::string state = ((sindex < states.size()) ? states[sindex] : "");
+    double age = ((scode & 1) ? get_double() : 0.0);
+    double weight = ((scode & 2) ? get_double() : (par ? par->weight : 1.0));
+    return cells.cell(idcode,time,age,state,weight,par);
+  }
+
+  // buffered input helpers
+  bool get_bytes(char *dest,std::size_t n)
+  {
+    while (n > 0) {
+      if (pos == buffer.size()) {
+	buffer.resize(eventlog::buffer_size);
+	from_file.read(&buffer[0],buffer.size());
+	buffer.resize(from_file.gcount());
+	pos = 0;
+	if (buffer.empty()) {
+	  good = false;
+	  return false;
+	}
+      }
+      std::size_t k = std::min(n,buffer.size() - pos);
+      std::memcpy(dest,buffer.data() + pos,k);
+      pos += k;
+      dest += k;
+      n -= k;
+    }
+    return true;
+  }
+  uint64_t get_varint()
+  {
+    uint64_t v = 0;
+    int shift = 0;
+    char b = 0;
+    do {
+      if (!get_bytes(&b,1)) {return 0;}
+      v |= uint64_t(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    return v;
+  }
+  double get_double()
+  {
+    double d = 0.0;
+    char bytes[sizeof(double)];
+    if (get_bytes(bytes,sizeof(double))) {std::memcpy(&d,bytes,sizeof(double));}
+    return d;
+  }
+
+  std::ifstream from_file;
+  std::string buffer;
+  std::size_t pos = 0;
+  bool good = true;
+  // living cells and state table for the current trajectory
+  ReplayCells cells;
+  std::vector<std::string> states;
+};
+
+#endif
@@ -0,0 +1,515 @@
+
+/* c++11 block samplers for branching process waiting times
+ *
+ * Waiting time draws (gamma in particular) are one of the most expensive
+ * parts of a cell's get_next_event. These samplers fill whole blocks of
+ * variates at once and hand them out one at a time from a buffer, so cells
+ * can keep using a plain std::function<double()> reference.
+ *
+ * The log, exp and sin/cos steps go through the array kernels in namespace
+ * vmath, which use AVX-512 or AVX2+FMA intrinsics when the build targets
+ * them (SIMD in the Makefile, e.g. -march=native) and otherwise fall back to
+ * the scalar std:: functions. Engine draws themselves stay serial.
+ */
+
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+
+#if defined(__AVX512F__)
+#define SAMPLING_SIMD_WIDTH 8
+#elif defined(__AVX2__) && defined(__FMA__)
+#define SAMPLING_SIMD_WIDTH 4
+#endif
+
+#ifdef SAMPLING_SIMD_WIDTH
+#include <immintrin.h>
+#endif
+
+/****************
+ * VECTOR MATH  *
+ ****************/
+/*
+ * log, exp and sin/cos(2 pi u) over arrays
+ *
+ * Vec wraps the intrinsics of the widest unit the build targets, and the
+ * vlog/vexp/vsincos2pi templates are written once against it:
+ * -- log: split off the exponent, 2 atanh((m-1)/(m+1)) series on the mantissa
+ * -- exp: n = round(x/ln2), Taylor series on the remainder, 2^n from the exponent bits
+ *    as two factors so subnormal and near overflow results round like std::exp
+ * -- sin/cos(2 pi u): reduce to |x| <= pi/4 by quadrant, Taylor series for both
+ * All three are within a few ulp of std:: for the arguments the samplers use
+ * (log of positive normal numbers, exp over the whole double range,
+ * sin/cos of u in [0,1]).
+ */
+namespace vmath {
+
+#ifdef SAMPLING_SIMD_WIDTH
+#if SAMPLING_SIMD_WIDTH == 8
+struct Vec {
+  typedef __m512d R;
+  typedef __m512i I;
+  typedef __mmask8 M;
+  static R load(const double *p) {return _mm512_loadu_pd(p);}
+  static void store(double *p,R x) {_mm512_storeu_pd(p,x);}
+  static R set(double x) {return _mm512_set1_pd(x);}
+  static R add(R a,R b) {return _mm512_add_pd(a,b);}
+  static R sub(R a,R b) {return _mm512_sub_pd(a,b);}
+  static R mul(R a,R b) {return _mm512_mul_pd(a,b);}
+  static R div(R a,R b) {return _mm512_div_pd(a,b);}
+  static R fma(R a,R b,R c) {return _mm512_fmadd_pd(a,b,c);}
+  static R sqrt(R a) {return _mm512_sqrt_pd(a);}
+  static R min(R a,R b) {return _mm512_min_pd(a,b);}
+  static R max(R a,R b) {return _mm512_max_pd(a,b);}
+  static R round(R a) {return _mm512_roundscale_pd(a,_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);}
+  static R floor(R a) {return _mm512_roundscale_pd(a,_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);}
+  static M lt(R a,R b) {return _mm512_cmp_pd_mask(a,b,_CMP_LT_OQ);}
+  static M gt(R a,R b) {return _mm512_cmp_pd_mask(a,b,_CMP_GT_OQ);}
+  static M eq(R a,R b) {return _mm512_cmp_pd_mask(a,b,_CMP_EQ_OQ);}
+  static R select(M m,R a,R b) {return _mm512_mask_blend_pd(m,b,a);} // m ? a : b
+  static I bits(R a) {return _mm512_castpd_si512(a);}
+  static R from_bits(I a) {return _mm512_castsi512_pd(a);}
+  static I iset(uint64_t x) {return _mm512_set1_epi64((long long)x);}
+  static I iand(I a,I b) {return _mm512_and_si512(a,b);}
+  static I ior(I a,I b) {return _mm512_or_si512(a,b);}
+  static I iadd(I a,I b) {return _mm512_add_epi64(a,b);}
+  static I isub(I a,I b) {return _mm512_sub_epi64(a,b);}
+  static I srl52(I a) {return _mm512_srli_epi64(a,52);}
+  static I sll52(I a) {return _mm512_slli_epi64(a,52);}
+};
+#else
+struct Vec {
+  typedef __m256d R;
+  typedef __m256i I;
+  typedef __m256d M;
+  static R load(const double *p) {return _mm256_loadu_pd(p);}
+  static void store(double *p,R x) {_mm256_storeu_pd(p,x);}
+  static R set(double x) {return _mm256_set1_pd(x);}
+  static R add(R a,R b) {return _mm256_add_pd(a,b);}
+  static R sub(R a,R b) {return _mm256_sub_pd(a,b);}
+  static R mul(R a,R b) {return _mm256_mul_pd(a,b);}
+  static R div(R a,R b) {return _mm256_div_pd(a,b);}
+  static R fma(R a,R b,R c) {return _mm256_fmadd_pd(a,b,c);}
+  static R sqrt(R a) {return _mm256_sqrt_pd(a);}
+  static R min(R a,R b) {return _mm256_min_pd(a,b);}
+  static R max(R a,R b) {return _mm256_max_pd(a,b);}
+  static R round(R a) {return _mm256_round_pd(a,_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);}
+  static R floor(R a) {return _mm256_floor_pd(a);}
+  static M lt(R a,R b) {return _mm256_cmp_pd(a,b,_CMP_LT_OQ);}
+  static M gt(R a,R b) {return _mm256_cmp_pd(a,b,_CMP_GT_OQ);}
+  static M eq(R a,R b) {return _mm256_cmp_pd(a,b,_CMP_EQ_OQ);}
+  static R select(M m,R a,R b) {return _mm256_blendv_pd(b,a,m);} // m ? a : b
+  static I bits(R a) {return _mm256_castpd_si256(a);}
+  static R from_bits(I a) {return _mm256_castsi256_pd(a);}
+  static I iset(uint64_t x) {return _mm256_set1_epi64x((long long)x);}
+  static I iand(I a,I b) {return _mm256_and_si256(a,b);}
+  static I ior(I a,I b) {return _mm256_or_si256(a,b);}
+  static I iadd(I a,I b) {return _mm256_add_epi64(a,b);}
+  static I isub(I a,I b) {return _mm256_sub_epi64(a,b);}
+  static I srl52(I a) {return _mm256_srli_epi64(a,52);}
+  static I sll52(I a) {return _mm256_slli_epi64(a,52);}
+};
+#endif
+const std::size_t width = SAMPLING_SIMD_WIDTH;
+#endif
+
+const double ln2_hi = 6.93147180369123816490e-01; // n * ln2_hi is exact for |n| < 2^11
+const double ln2_lo = 1.90821492927058770002e-10;
+
+// natural log of positive normal numbers
+template <class V>
+typename V::R vlog(typename V::R x)
+{
+  typedef typename V::R R;
+  typename V::I b = V::bits(x);
+  // biased exponent dropped into the mantissa of 2^52 -- avoids a 64 bit int to double convert
+  R e = V::sub(V::from_bits(V::ior(V::srl52(b),V::iset(0x4330000000000000ull))),V::set(4503599627371519.0));
+  R m = V::from_bits(V::ior(V::iand(b,V::iset(0x000FFFFFFFFFFFFFull)),V::iset(0x3FF0000000000000ull)));
+  // mantissa to [sqrt(1/2),sqrt(2))
+  typename V::M big = V::gt(m,V::set(1.4142135623730951));
+  m = V::select(big,V::mul(m,V::set(0.5)),m);
+  e = V::select(big,V::add(e,V::set(1.0)),e);
+  // log(m) = 2 atanh(s) = 2 s (1 + s^2/3 + s^4/5 + ...), |s| < 0.172
+  R s = V::div(V::sub(m,V::set(1.0)),V::add(m,V::set(1.0)));
+  R z = V::mul(s,s);
+  R p = V::set(1.0/21.0);
+  p = V::fma(p,z,V::set(1.0/19.0));
+  p = V::fma(p,z,V::set(1.0/17.0));
+  p = V::fma(p,z,V::set(1.0/15.0));
+  p = V::fma(p,z,V::set(1.0/13.0));
+  p = V::fma(p,z,V::set(1.0/11.0));
+  p = V::fma(p,z,V::set(1.0/9.0));
+  p = V::fma(p,z,V::set(1.0/7.0));
+  p = V::fma(p,z,V::set(1.0/5.0));
+  p = V::fma(p,z,V::set(1.0/3.0));
+  R t = V::mul(V::add(s,s),z);
+  R lo = V::fma(t,p,V::mul(e,V::set(ln2_lo)));
+  return V::fma(e,V::set(ln2_hi),V::add(V::add(s,s),lo));
+}
+
+// 2^n for integer valued n in the normal exponent range
+template <class V>
+typename V::R vpow2(typename V::R n)
+{
+  // n + 1.5*2^52 holds n in its low mantissa bits
+  typename V::I k = V::isub(V::bits(V::add(n,V::set(6755399441055744.0))),V::iset(0x4338000000000000ull));
+  return V::from_bits(V::sll52(V::iadd(k,V::iset(1023))));
+}
+
+// exp -- 0 below and inf above the double range, like std::exp
+template <class V>
+typename V::R vexp(typename V::R x)
+{
+  typedef typename V::R R;
+  R xc = V::min(V::max(x,V::set(-745.2)),V::set(709.79));
+  R n = V::round(V::mul(xc,V::set(1.4426950408889634)));
+  R r = V::fma(n,V::set(-ln2_hi),xc);
+  r = V::fma(n,V::set(-ln2_lo),r);
+  // Taylor series to r^13/13!, |r| <= ln2/2
+  R p = V::set(1.0/6227020800.0);
+  p = V::fma(p,r,V::set(1.0/479001600.0));
+  p = V::fma(p,r,V::set(1.0/39916800.0));
+  p = V::fma(p,r,V::set(1.0/3628800.0));
+  p = V::fma(p,r,V::set(1.0/362880.0));
+  p = V::fma(p,r,V::set(1.0/40320.0));
+  p = V::fma(p,r,V::set(1.0/5040.0));
+  p = V::fma(p,r,V::set(1.0/720.0));
+  p = V::fma(p,r,V::set(1.0/120.0));
+  p = V::fma(p,r,V::set(1.0/24.0));
+  p = V::fma(p,r,V::set(1.0/6.0));
+  p = V::fma(p,r,V::set(0.5));
+  p = V::fma(p,r,V::set(1.0));
+  p = V::fma(p,r,V::set(1.0));
+  // n runs from -1075 to 1024, past the normal exponents, so scale by
+  // 2^h * 2^(n-h) with h = floor(n/2) -- only the last product can round
+  R h = V::floor(V::mul(n,V::set(0.5)));
+  R y = V::mul(V::mul(p,vpow2<V>(h)),vpow2<V>(V::sub(n,h)));
+  y = V::select(V::lt(x,V::set(-745.2)),V::set(0.0),y);
+  y = V::select(V::gt(x,V::set(709.79)),V::set(std::numeric_limits<double>::infinity()),y);
+  return y;
+}
+
+// s = sin(2 pi u), c = cos(2 pi u)
+template <class V>
+void vsincos2pi(typename V::R u,typename V::R &s,typename V::R &c)
+{
+  typedef typename V::R R;
+  // quadrant q, remainder x = 2 pi (u - q/4) in [-pi/4,pi/4]
+  R q = V::round(V::mul(u,V::set(4.0)));
+  R x = V::mul(V::fma(q,V::set(-0.25),u),V::set(6.283185307179586));
+  R x2 = V::mul(x,x);
+  R sp = V::set(-1.0/1307674368000.0);
+  sp = V::fma(sp,x2,V::set(1.0/6227020800.0));
+  sp = V::fma(sp,x2,V::set(-1.0/39916800.0));
+  sp = V::fma(sp,x2,V::set(1.0/362880.0));
+  sp = V::fma(sp,x2,V::set(-1.0/5040.0));
+  sp = V::fma(sp,x2,V::set(1.0/120.0));
+  sp = V::fma(sp,x2,V::set(-1.0/6.0));
+  R sx = V::fma(V::mul(sp,x2),x,x);
+  R cp = V::set(1.0/20922789888000.0);
+  cp = V::fma(cp,x2,V::set(-1.0/87178291200.0));
+  cp = V::fma(cp,x2,V::set(1.0/479001600.0));
+  cp = V::fma(cp,x2,V::set(-1.0/3628800.0));
+  cp = V::fma(cp,x2,V::set(1.0/40320.0));
+  cp = V::fma(cp,x2,V::set(-1.0/720.0));
+  cp = V::fma(cp,x2,V::set(1.0/24.0));
+  cp = V::fma(cp,x2,V::set(-0.5));
+  R cx = V::fma(cp,x2,V::set(1.0));
+  // rotate by q quarter turns
+  R k = V::sub(q,V::mul(V::floor(V::mul(q,V::set(0.25))),V::set(4.0)));
+  typename V::M k1 = V::eq(k,V::set(1.0));
+  typename V::M k2 = V::eq(k,V::set(2.0));
+  typename V::M k3 = V::eq(k,V::set(3.0));
+  R nsx = V::sub(V::set(0.0),sx);
+  R ncx = V::sub(V::set(0.0),cx);
+  s = V::select(k1,cx,V::select(k2,nsx,V::select(k3,ncx,sx)));
+  c = V::select(k1,nsx,V::select(k2,ncx,V::select(k3,sx,cx)));
+}
+
+/*
+ * Array kernels -- full vectors through the templates above, the
+ * remainder (and everything in a scalar build) through std::
+ * out may alias the input
+ */
+inline void log_array(const double *x,double *out,std::size_t n)
+{
+  std::size_t i = 0;
+#ifdef SAMPLING_SIMD_WIDTH
+  for (; i + width <= n; i += width) {Vec::store(out + i,vlog<Vec>(Vec::load(x + i)));}
+#endif
+  for (; i < n; ++i) {out[i] = std::log(x[i]);}
+}
+
+inline void exp_array(const double *x,double *out,std::size_t n)
+{
+  std::size_t i = 0;
+#ifdef SAMPLING_SIMD_WIDTH
+  for (; i + width <= n; i += width) {Vec::store(out + i,vexp<Vec>(Vec::load(x + i)));}
+#endif
+  for (; i < n; ++i) {out[i] = std::exp(x[i]);}
+}
+
+// Box-Muller -- uniforms u1,u2 on (0,1] to normals z1,z2
+inline void box_muller(const double *u1,const double *u2,double *z1,double *z2,std::size_t n)
+{
+  std::size_t i = 0;
+#ifdef SAMPLING_SIMD_WIDTH
+  for (; i + width <= n; i += width) {
+    Vec::R r = Vec::sqrt(Vec::mul(Vec::set(-2.0),vlog<Vec>(Vec::load(u1 + i))));
+    Vec::R s,c;
+    vsincos2pi<Vec>(Vec::load(u2 + i),s,c);
+    Vec::store(z1 + i,Vec::mul(r,c));
+    Vec::store(z2 + i,Vec::mul(r,s));
+  }
+#endif
+  const double two_pi = 6.283185307179586;
+  for (; i < n; ++i) {
+    double r = std::sqrt(-2.0 * std::log(u1[i]));
+    double a = two_pi * u2[i];
+    double c = r * std::cos(a);
+    double s = r * std::sin(a);
+    z1[i] = c;
+    z2[i] = s;
+  }
+}
+
+}
+
+/*********************
+ * UNIFORM / NORMAL  *
+ *********************/
+/*
+ * Fill out[0..n) with uniforms on (0,1] -- never 0, so safe to log
+ * uses the top 53 bits of a 64 bit engine draw
+ */
+template <class URNG>
+void fill_uniform(URNG &gen,double *out,std::size_t n)
+{
+  static_assert(URNG::min() == 0 && URNG::max() == 0xFFFFFFFFFFFFFFFFull,
+		"block samplers need a full 64 bit engine, e.g. std::mt19937_64");
+  const double scale = 1.0 / 9007199254740992.0; // 2^-53
+  for (std::size_t i = 0; i < n; ++i) {
+    out[i] = (double((uint64_t(gen()) >> 11) & 0x1FFFFFFFFFFFFFull) + 1.0) * scale;
+  }
+}
+
+/*
+ * Fill out[0..n) with standard normals using Box-Muller on uniform pairs
+ * -- scratch holds the uniforms so the transform runs over whole arrays
+ */
+template <class URNG>
+void fill_normal(URNG &gen,double *out,std::size_t n,std::vector<double> &scratch)
+{
+  std::size_t half = (n + 1) / 2;
+  scratch.resize(2*half);
+  fill_uniform(gen,scratch.data(),2*half);
+  // transform in place over u1/u2
+  vmath::box_muller(scratch.data(),scratch.data() + half,scratch.data(),scratch.data() + half,half);
+  std::copy(scratch.begin(),scratch.begin() + n,out);
+}
+
+/*****************
+ * BLOCK KERNELS *
+ *****************/
+/*
+ * Block kernel interface -- each kernel implements
+ * -- fill(gen,out,n): write n independent variates to out
+ * kernels keep their own scratch space so repeated fills don't allocate
+ */
+
+/*
+ * Exponential with given rate (same parameterization as std::exponential_distribution)
+ */
+class ExponentialBlock {
+public:
+  ExponentialBlock(double r=1.0) : rate(r) {}
+  template <class URNG>
+  void fill(URNG &gen,double *out,std::size_t n)
+  {
+    fill_uniform(gen,out,n);
+    vmath::log_array(out,out,n);
+    const double scale = -1.0 / rate;
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] *= scale;
+    }
+  }
+private:
+  double rate;
+};
+
+/*
+ * Gamma with given shape and scale (same parameterization as std::gamma_distribution)
+ *
+ * Marsaglia-Tsang squeeze/rejection done a block at a time:
+ * candidates and squeeze flags are computed for the whole block,
+ * then accepted values are compacted into out. Rejections are rare
+ * (< 5% for shape >= 1) so the loop only repeats for a short tail.
+ * For shape < 1 we sample shape+1 and scale by u^(1/shape).
+ */
+class GammaBlock {
+public:
+  GammaBlock(double a=1.0,double b=1.0) : shape(a),scale(b)
+  {
+    double s = ((shape < 1.0) ? shape + 1.0 : shape);
+    d = s - 1.0/3.0;
+    c = 1.0 / std::sqrt(9.0 * d);
+  }
+  template <class URNG>
+  void fill(URNG &gen,double *out,std::size_t n)
+  {
+    std::size_t filled = 0;
+    while (filled < n) {
+      // small oversampling so a single pass usually suffices
+      std::size_t m = (n - filled) + (n - filled) / 16 + 4;
+      z.resize(m); u.resize(m); v.resize(m); ok.resize(m);
+      fill_normal(gen,z.data(),m,scratch);
+      fill_uniform(gen,u.data(),m);
+      // cheap squeeze test for the whole block
+      for (std::size_t i = 0; i < m; ++i) {
+	double t = 1.0 + c * z[i];
+	double t3 = t * t * t;
+	double z2 = z[i] * z[i];
+	// 0 reject, 1 needs the log test, 2 accepted by the squeeze
+	ok[i] = (t3 > 0.0) * (1 + (u[i] < 1.0 - 0.0331 * z2 * z2));
+	v[i] = t3;
+      }
+      // full log test only for the few that missed the squeeze
+      for (std::size_t i = 0; i < m && filled < n; ++i) {
+	if (ok[i] == 2 ||
+	    (ok[i] == 1 && std::log(u[i]) < 0.5*z[i]*z[i] + d*(1.0 - v[i] + std::log(v[i])))) {
+	  out[filled++] = d * v[i] * scale;
+	}
+      }
+    }
+    if (shape < 1.0) {
+      // boost to shape < 1 -- gamma(a) = gamma(a+1) * u^(1/a)
+      u.resize(n);
+      fill_uniform(gen,u.data(),n);
+      vmath::log_array(u.data(),u.data(),n);
+      const double inv_shape = 1.0 / shape;
+      for (std::size_t i = 0; i < n; ++i) {
+	u[i] *= inv_shape;
+      }
+      vmath::exp_array(u.data(),u.data(),n);
+      for (std::size_t i = 0; i < n; ++i) {
+	out[i] *= u[i];
+      }
+    }
+  }
+private:
+  double shape;
+  double scale;
+  double d,c; // Marsaglia-Tsang constants
+  std::vector<double> z,u,v,scratch;
+  std::vector<unsigned char> ok;
+};
+
+/*
+ * Lognormal -- exp(m + s*Z) (same parameterization as std::lognormal_distribution)
+ */
+class LognormalBlock {
+public:
+  LognormalBlock(double m=0.0,double s=1.0) : mu(m),sigma(s) {}
+  template <class URNG>
+  void fill(URNG &gen,double *out,std::size_t n)
+  {
+    fill_normal(gen,out,n,scratch);
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] = mu + sigma * out[i];
+    }
+    vmath::exp_array(out,out,n);
+  }
+private:
+  double mu;
+  double sigma;
+  std::vector<double> scratch;
+};
+
+/*
+ * Two component mixture -- with probability p from First, otherwise from Second
+ *
+ * Rather than drawing a Bernoulli and then one variate per slot, we draw
+ * the component labels for the block, fill each component in one call
+ * with exactly as many variates as it needs, then scatter them back.
+ */
+template <class First,class Second>
+class MixtureBlock {
+public:
+  MixtureBlock(double p,First f,Second s) : prob(p),first(f),second(s) {}
+  template <class URNG>
+  void fill(URNG &gen,double *out,std::size_t n)
+  {
+    u.resize(n);
+    fill_uniform(gen,u.data(),n);
+    std::size_t nfirst = 0;
+    for (std::size_t i = 0; i < n; ++i) {nfirst += (u[i] <= prob);}
+    a.resize(nfirst);
+    b.resize(n - nfirst);
+    first.fill(gen,a.data(),a.size());
+    second.fill(gen,b.data(),b.size());
+    std::size_t ia = 0, ib = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] = ((u[i] <= prob) ? a[ia++] : b[ib++]);
+    }
+  }
+private:
+  double prob;
+  First first;
+  Second second;
+  std::vector<double> u,a,b;
+};
+
+/*
+ * Helper for building mixtures without spelling out the template arguments
+ */
+template <class First,class Second>
+MixtureBlock<First,Second> make_mixture(double p,First f,Second s)
+{
+  return MixtureBlock<First,Second>(p,f,s);
+}
+
+/********************
+ * BUFFERED SAMPLER *
+ ********************/
+/*
+ * BatchSampler holds a block of pre-drawn variates and hands them out
+ * one at a time, refilling the whole block through the kernel when empty.
+ *
+ * Intended to live alongside the rng for a process (or ensemble) and be
+ * wrapped in the std::function<double()> that cells hold by reference:
+ *   BatchSampler<GammaBlock,std::mt19937_64> gam(gen,GammaBlock(3.0,1.0/3.0));
+ *   std::function<double()> gam_wt = [&](){return gam();};
+ */
+template <class Kernel,class URNG>
+class BatchSampler {
+public:
+  BatchSampler(URNG &g,Kernel k,std::size_t block=4096) :
+    gen(g),kernel(k),buffer(block),pos(block) {}
+
+  double operator()()
+  {
+    if (pos == buffer.size()) {refill();}
+    return buffer[pos++];
+  }
+
+  // drop any buffered draws, e.g. after reseeding the engine
+  void reset() {pos = buffer.size();}
+
+private:
+  void refill()
+  {
+    kernel.fill(gen,buffer.data(),buffer.size());
+    pos = 0;
+  }
+  URNG &gen; // engine REFERENCE -- shared with the rest of the process
+  Kernel kernel;
+  std::vector<double> buffer;
+  std::size_t pos;
+};
+
+#endif
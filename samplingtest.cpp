@@ -0,0 +1,164 @@
+
+/*
+ * Statistical checks of the block samplers in sampling.h
+ *
+ * For every kernel draws a large sample through BatchSampler and checks
+ * -- mean and variance against the exact values (within 5 standard errors)
+ * -- two sample Kolmogorov-Smirnov distance against the std:: distribution
+ * plus the vmath array kernels against std::log/exp/sin/cos.
+ * Exits non zero if any check fails (make test).
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include "sampling.h"
+
+const std::size_t NSAMPLE = 1000000;
+const double NSE = 5.0; // standard errors allowed on the moments
+const double KS_CRIT = 1.95; // alpha = 0.001
+int failures = 0;
+
+void check(const std::string &name,bool ok,double got,double want)
+{
+  std::cout << (ok ? "ok   " : "FAIL ") << name << ' ' << got << " (" << want << ')' << std::endl;
+  if (!ok) {++failures;}
+}
+
+// largest gap between the empirical cdfs of two sorted samples
+double ks_distance(const std::vector<double> &a,const std::vector<double> &b)
+{
+  double d = 0.0;
+  std::size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    if (a[i] < b[j]) {++i;} else {++j;}
+    d = std::max(d,std::abs(double(i) / a.size() - double(j) / b.size()));
+  }
+  return d;
+}
+
+void test_sampler(const std::string &name,std::function<double()> sampler,
+		  std::function<double()> reference,double mean,double var)
+{
+  std::vector<double> x(NSAMPLE), y(NSAMPLE);
+  for (auto &xi : x) {xi = sampler();}
+  for (auto &yi : y) {yi = reference();}
+
+  double m = 0.0;
+  for (auto xi : x) {m += xi;}
+  m /= NSAMPLE;
+  double m2 = 0.0, m4 = 0.0;
+  for (auto xi : x) {
+    double d2 = (xi - m) * (xi - m);
+    m2 += d2;
+    m4 += d2 * d2;
+  }
+  m2 /= NSAMPLE;
+  m4 /= NSAMPLE;
+  double se_mean = std::sqrt(var / NSAMPLE);
+  double se_var = std::sqrt((m4 - m2 * m2) / NSAMPLE);
+  check(name + " mean",std::abs(m - mean) < NSE * se_mean,m,mean);
+  check(name + " variance",std::abs(m2 - var) < NSE * se_var,m2,var);
+
+  std::sort(x.begin(),x.end());
+  std::sort(y.begin(),y.end());
+  double crit = KS_CRIT * std::sqrt(2.0 / NSAMPLE);
+  double ks = ks_distance(x,y);
+  check(name + " KS",ks < crit,ks,crit);
+}
+
+// largest relative error of an array kernel against its scalar reference
+// -- subnormal results are compared relative to the smallest normal double
+double max_rel_error(std::vector<double> &in,std::vector<double> &out,std::function<double(double)> f)
+{
+  double err = 0.0;
+  for (std::size_t i = 0; i < in.size(); ++i) {
+    double want = f(in[i]);
+    double scale = std::max(std::abs(want),std::numeric_limits<double>::min());
+    if (std::isinf(want)) {
+      err = std::max(err,((out[i] == want) ? 0.0 : 1.0));
+    }
+    else {
+      err = std::max(err,std::abs(out[i] - want) / scale);
+    }
+  }
+  return err;
+}
+
+void test_vmath(std::mt19937_64 &gen)
+{
+  std::size_t n = 100003; // not a multiple of the vector width
+  std::vector<double> u(n), out(n);
+  fill_uniform(gen,u.data(),n);
+  vmath::log_array(u.data(),out.data(),n);
+  double err = max_rel_error(u,out,[](double a){return std::log(a);});
+  check("vmath log",err < 1e-14,err,1e-14);
+
+  std::vector<double> x(n);
+  // the whole double range, subnormal results and overflow included
+  for (std::size_t i = 0; i < n; ++i) {x[i] = 1455.0 * u[i] - 745.0;}
+  vmath::exp_array(x.data(),out.data(),n);
+  err = max_rel_error(x,out,[](double a){return std::exp(a);});
+  check("vmath exp",err < 1e-14,err,1e-14);
+
+  // u1 = e^-1/2 gives r = 1, leaving cos and sin of 2 pi u2
+  std::vector<double> z1(n), z2(n), e(n,std::exp(-0.5));
+  vmath::box_muller(e.data(),u.data(),z1.data(),z2.data(),n);
+  err = 0.0;
+  for (std::size_t i = 0; i < n; ++i) {
+    err = std::max(err,std::abs(z1[i] - std::cos(6.283185307179586 * u[i])));
+    err = std::max(err,std::abs(z2[i] - std::sin(6.283185307179586 * u[i])));
+  }
+  check("vmath sincos",err < 1e-14,err,1e-14);
+}
+
+int main(int argc, char const ** argv)
+{
+  std::mt19937_64 gen(20150301);
+  std::mt19937_64 ref(20150302);
+  test_vmath(gen);
+
+  {
+    BatchSampler<ExponentialBlock,std::mt19937_64> s(gen,ExponentialBlock(0.5));
+    std::exponential_distribution<double> d(0.5);
+    test_sampler("exponential(0.5)",[&](){return s();},[&](){return d(ref);},2.0,4.0);
+  }
+  {
+    BatchSampler<GammaBlock,std::mt19937_64> s(gen,GammaBlock(3.0,1.0/3.0));
+    std::gamma_distribution<double> d(3.0,1.0/3.0);
+    test_sampler("gamma(3,1/3)",[&](){return s();},[&](){return d(ref);},1.0,1.0/3.0);
+  }
+  {
+    BatchSampler<GammaBlock,std::mt19937_64> s(gen,GammaBlock(0.4,2.0));
+    std::gamma_distribution<double> d(0.4,2.0);
+    test_sampler("gamma(0.4,2)",[&](){return s();},[&](){return d(ref);},0.8,1.6);
+  }
+  {
+    BatchSampler<LognormalBlock,std::mt19937_64> s(gen,LognormalBlock(0.1,0.5));
+    std::lognormal_distribution<double> d(0.1,0.5);
+    double mean = std::exp(0.1 + 0.125);
+    double var = (std::exp(0.25) - 1.0) * std::exp(0.2 + 0.25);
+    test_sampler("lognormal(0.1,0.5)",[&](){return s();},[&](){return d(ref);},mean,var);
+  }
+  {
+    auto k = make_mixture(0.3,ExponentialBlock(1.0),GammaBlock(0.5,4.0));
+    BatchSampler<decltype(k),std::mt19937_64> s(gen,k);
+    std::bernoulli_distribution coin(0.3);
+    std::exponential_distribution<double> d1(1.0);
+    std::gamma_distribution<double> d2(0.5,4.0);
+    // p (var1 + mean1^2) + (1-p) (var2 + mean2^2) - mean^2
+    double mean = 0.3 * 1.0 + 0.7 * 2.0;
+    double var = 0.3 * 2.0 + 0.7 * (8.0 + 4.0) - mean * mean;
+    test_sampler("mixture(0.3,exp(1),gamma(0.5,4))",[&](){return s();},
+		 [&](){return (coin(ref) ? d1(ref) : d2(ref));},mean,var);
+  }
+
+  std::cout << failures << " failures" << std::endl;
+  return ((failures == 0) ? 0 : 1);
+}